@@ -0,0 +1,144 @@
+/*
+ * Copyright (C) 2018 Datto, Inc.
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ * Fedora-License-Identifier: LGPLv2+
+ * SPDX-2.0-License-Identifier: LGPL-2.1+
+ * SPDX-3.0-License-Identifier: LGPL-2.1-or-later
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#include "crc32c.h"
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78U
+
+static uint32_t crc32c_table[256];
+//x^(2^n) mod p for every n a 64-bit byte count can need (n = 3..66)
+static uint32_t crc32c_x2n_table[67];
+static uint32_t (*crc32c_impl)(uint32_t, const uint8_t *, size_t);
+
+/**************************************/
+/****** CHECKSUM IMPLEMENTATIONS ******/
+/**************************************/
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *buf, size_t length) {
+	while(length--){
+		crc = crc32c_table[(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *buf, size_t length) {
+	uint64_t crc64 = crc, word;
+
+	//get the buffer 8-byte aligned so the main loop can do full words
+	while(length > 0 && ((uintptr_t)buf & 7) != 0){
+		crc64 = _mm_crc32_u8(crc64, *buf++);
+		length--;
+	}
+
+	while(length >= sizeof(uint64_t)){
+		memcpy(&word, buf, sizeof(uint64_t));
+		crc64 = _mm_crc32_u64(crc64, word);
+		buf += sizeof(uint64_t);
+		length -= sizeof(uint64_t);
+	}
+
+	while(length--){
+		crc64 = _mm_crc32_u8(crc64, *buf++);
+	}
+
+	return crc64;
+}
+#endif
+
+/*
+ * Multiply a and b modulo the crc polynomial, with both in the reflected bit
+ * order used by the crc itself.
+ */
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+	uint32_t m = 1U << 31, p = 0;
+
+	for(;;){
+		if(a & m){
+			p ^= b;
+			if((a & (m - 1)) == 0) break;
+		}
+		m >>= 1;
+		b = (b & 1) ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+
+	return p;
+}
+
+/****************************/
+/****** PUBLIC HELPERS ******/
+/****************************/
+
+void crc32c_init(void) {
+	uint32_t crc;
+	int i, j;
+
+	for(i = 0; i < 256; i++){
+		crc = i;
+		for(j = 0; j < 8; j++){
+			crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[i] = crc;
+	}
+
+	crc32c_x2n_table[0] = 1U << 30;
+	for(i = 1; i < sizeof(crc32c_x2n_table) / sizeof(crc32c_x2n_table[0]); i++){
+		crc32c_x2n_table[i] = multmodp(crc32c_x2n_table[i - 1], crc32c_x2n_table[i - 1]);
+	}
+
+	crc32c_impl = crc32c_sw;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")) crc32c_impl = crc32c_hw;
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t length) {
+	return ~crc32c_impl(~crc, buf, length);
+}
+
+/*
+ * Extending a crc over a run of zeroes only multiplies the register by
+ * x^(8 * length), so this is logarithmic in length instead of linear.
+ */
+uint32_t crc32c_zeroes(uint32_t crc, uint64_t length) {
+	uint32_t p = 1U << 31;
+	int k = 3;
+
+	while(length != 0){
+		if(length & 1) p = multmodp(crc32c_x2n_table[k], p);
+		length >>= 1;
+		k++;
+	}
+
+	return ~multmodp(p, ~crc);
+}
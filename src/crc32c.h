@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2018 Datto, Inc.
+ *
+ * Licensed under the GNU Lesser General Public License Version 2.1
+ * Fedora-License-Identifier: LGPLv2+
+ * SPDX-2.0-License-Identifier: LGPL-2.1+
+ * SPDX-3.0-License-Identifier: LGPL-2.1-or-later
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC32C (Castagnoli) as used by Ceph and iSCSI. Both functions take the
+ * crc of the preceding data (0 to start) and return the updated crc, so
+ * an extent may be hashed in several pieces.
+ */
+void crc32c_init(void);
+uint32_t crc32c(uint32_t crc, const void *buf, size_t length);
+uint32_t crc32c_zeroes(uint32_t crc, uint64_t length);
+
+#endif
@@ -24,12 +24,69 @@
 
 #include "zfstypes.h"
 #include "cephtypes.h"
+#include "crc32c.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
+
+struct dataset_size {
+	char *dataset;
+	uint64_t size;
+};
+
+struct chunk_buf {
+	uint8_t *buf;
+	uint64_t size;
+	uint64_t mapped;
+};
+
+struct extent {
+	uint64_t start;
+	uint64_t end;
+};
+
+/*
+ * Sorted, non-overlapping list of the byte ranges written so far. Adjacent
+ * writes merge, so there is one 16 byte entry per run of written blocks, and
+ * memory grows with how fragmented the zvol is: a few entries for a mostly
+ * contiguous image, but many MiB for one with millions of separate runs.
+ */
+struct extent_map {
+	struct extent *extents;
+	size_t count;
+	size_t alloc;
+};
+
+//outputs already finished, so a failed package can be removed as a whole
+struct path_list {
+	char **paths;
+	size_t count;
+};
+
+struct convert_opts {
+	//single stream output, unused when writing a diff per substream into out_dir
+	FILE *outfile;
+	FILE *manifest;
+
+	char *out_dir;
+	char *manifest_dir;
+
+	//default image size, and any per-zvol overrides
+	uint64_t image_size;
+	struct dataset_size *sizes;
+	size_t nsizes;
+
+	//record payloads are streamed through a buffer of this many bytes
+	uint64_t chunk_size;
+
+	//full sends target a newly created, still sparse image
+	int fresh_image;
+};
 
 /**************************/
 /****** IO FUNCTIONS ******/
@@ -38,6 +95,8 @@
 #define read_header(pipe, drr) read_data(pipe, drr, sizeof(dmu_replay_record_t))
 #define EOF_SENTINEL -1
 #define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MANIFEST_BANNER "zfs2ceph crc32c manifest v1\n"
+#define DEFAULT_CHUNK_SIZE (2ULL << 20)
 
 
 static int write_data(FILE *pipe, void *buf, uint64_t size) {
@@ -79,15 +138,15 @@ error:
 	return ret;
 }
 
-int read_skip(FILE *pipe, uint64_t size){
+int read_skip(FILE *pipe, struct chunk_buf *chunk, uint64_t size){
 	int ret;
 	uint64_t bytes_next, bytes_left = size;
-	uint8_t buf[4096];
 
 	while(bytes_left != 0){
-		bytes_next = MIN(sizeof(buf), bytes_left);
+		bytes_next = MIN(chunk->size, bytes_left);
 
-		ret = read_data(pipe, buf, bytes_next);
+		ret = read_data(pipe, chunk->buf, bytes_next);
+		if(ret == EOF_SENTINEL) ret = EIO;
 		if(ret) goto error;
 
 		bytes_left -= bytes_next;
@@ -100,6 +159,107 @@ error:
 	return ret;
 }
 
+/*
+ * Copy size bytes from the pipe to the output a chunk at a time, so a record
+ * never has to be held in memory whole. If crc is given it is updated with
+ * the data copied.
+ */
+static int copy_data(FILE *pipe, FILE *outfile, struct chunk_buf *chunk, uint64_t size, uint32_t *crc){
+	int ret;
+	uint64_t bytes_next, bytes_left = size;
+
+	while(bytes_left != 0){
+		bytes_next = MIN(chunk->size, bytes_left);
+
+		ret = read_data(pipe, chunk->buf, bytes_next);
+		if(ret == EOF_SENTINEL) ret = EIO;
+		if(ret) goto error;
+
+		ret = write_data(outfile, chunk->buf, bytes_next);
+		if(ret) goto error;
+
+		if(crc) *crc = crc32c(*crc, chunk->buf, bytes_next);
+
+		bytes_left -= bytes_next;
+	}
+
+	return 0;
+
+error:
+	fprintf(stderr, "failed to copy data from pipe: %s\n", strerror(ret));
+	return ret;
+}
+
+/*
+ * The huge page size depends on the architecture and kernel configuration
+ * (2MiB on x86, up to 512MiB on arm64 with 64K pages), so ask the kernel for
+ * it. Returns 0 if it can't be determined.
+ */
+static uint64_t get_hugepage_size(void){
+	FILE *meminfo;
+	char line[128];
+	unsigned long long kib = 0;
+
+	meminfo = fopen("/proc/meminfo", "r");
+	if(!meminfo) return 0;
+
+	while(fgets(line, sizeof(line), meminfo)){
+		if(sscanf(line, "Hugepagesize: %llu kB", &kib) == 1) break;
+	}
+
+	fclose(meminfo);
+
+	return kib * 1024;
+}
+
+/*
+ * Chunk buffers are mapped rather than malloc'd so they can be backed by huge
+ * pages. Explicit hugetlb pages have to be reserved by the administrator, so
+ * when that fails we fall back to normal pages and ask for transparent ones.
+ */
+static int chunk_alloc(struct chunk_buf *chunk, uint64_t size){
+	int ret;
+	void *buf = MAP_FAILED;
+	uint64_t len, hugepage_size;
+
+	hugepage_size = get_hugepage_size();
+
+#ifdef MAP_HUGETLB
+	if(hugepage_size != 0 && P2PHASE(size, hugepage_size) == 0){
+		len = size;
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	}
+#endif
+
+	if(buf == MAP_FAILED){
+		len = P2ROUNDUP(size, (uint64_t)sysconf(_SC_PAGESIZE));
+		buf = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED){
+			ret = errno;
+			goto error;
+		}
+
+#ifdef MADV_HUGEPAGE
+		if(hugepage_size != 0 && len >= hugepage_size) madvise(buf, len, MADV_HUGEPAGE);
+#endif
+	}
+
+	chunk->buf = buf;
+	chunk->size = size;
+	chunk->mapped = len;
+
+	return 0;
+
+error:
+	fprintf(stderr, "failed to allocate chunk buffer: %s\n", strerror(ret));
+	return ret;
+}
+
+static void chunk_free(struct chunk_buf *chunk){
+	if(chunk->buf) munmap(chunk->buf, chunk->mapped);
+	chunk->buf = NULL;
+}
+
 /***************************************/
 /****** CEPH CONVERSION FUNCTIONS ******/
 /***************************************/
@@ -165,15 +325,8 @@ static int write_data_header(FILE *pipe, uint8_t tag, uint64_t offset, uint64_t
 	return write_data(pipe, &length, sizeof(uint64_t));
 }
 
-static int write_block(FILE *pipe, uint64_t offset, uint64_t length, uint8_t *buf) {
-	int r;
-
-	r = write_data_header(pipe, RBD_DIFF_WRITE, offset, length);
-	if (r) {
-		return r;
-	}
-
-	return write_data(pipe, buf, length);
+static int write_block(FILE *pipe, uint64_t offset, uint64_t length) {
+	return write_data_header(pipe, RBD_DIFF_WRITE, offset, length);
 }
 
 static int write_zeroes(FILE *pipe, uint64_t offset, uint64_t length) {
@@ -187,11 +340,136 @@ static int write_end_header(FILE *pipe) {
 	return write_data(pipe, &tag, sizeof(uint32_t));
 }
 
+/***************************************/
+/****** MANIFEST OUTPUT FUNCTIONS ******/
+/***************************************/
+
+/*
+ * The manifest is a text sidecar to the rbd diff with one line per write or
+ * zero extent giving its tag, offset, length and the crc32c of the data the
+ * image should hold there afterwards, e.g. "w 131072 131072 1a2b3c4d".
+ */
+static int write_manifest_header(FILE *manifest) {
+	uint64_t length;
+
+	length = strlen(MANIFEST_BANNER);
+	return write_data(manifest, MANIFEST_BANNER, length);
+}
+
+static int write_manifest_entry(FILE *manifest, uint8_t tag, uint64_t offset, uint64_t length, uint32_t crc) {
+	int ret;
+
+	ret = fprintf(manifest, "%c %lu %lu %08x\n", tag, offset, length, crc);
+	if(ret < 0){
+		ret = ferror(manifest) ? errno : EIO;
+		fprintf(stderr, "failed to write manifest entry: %s\n", strerror(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int write_zeroes_entry(FILE *outfile, FILE *manifest, uint64_t offset, uint64_t length) {
+	int ret;
+
+	ret = write_zeroes(outfile, offset, length);
+	if(ret) return ret;
+
+	if(manifest){
+		ret = write_manifest_entry(manifest, RBD_DIFF_ZERO, offset, length, crc32c_zeroes(0, length));
+		if(ret) return ret;
+	}
+
+	return 0;
+}
+
+/*************************************/
+/****** WRITTEN EXTENT TRACKING ******/
+/*************************************/
+
+//index of the first extent ending after offset, or map->count if there is none
+static size_t extent_map_find(struct extent_map *map, uint64_t offset) {
+	size_t lo = 0, hi = map->count, mid;
+
+	while(lo < hi){
+		mid = lo + (hi - lo) / 2;
+		if(map->extents[mid].end <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+
+	return lo;
+}
+
+static int extent_map_add(struct extent_map *map, uint64_t start, uint64_t end) {
+	struct extent *extents;
+	size_t first, last;
+
+	if(start == end) return 0;
+
+	//zfs sends blocks in offset order, so a write that continues the last run just extends it
+	if(map->count != 0 && map->extents[map->count - 1].end == start){
+		map->extents[map->count - 1].end = end;
+		return 0;
+	}
+
+	//find the run of extents that overlap or touch the new one and merge them into it
+	first = (start == 0) ? 0 : extent_map_find(map, start - 1);
+	for(last = first; last < map->count && map->extents[last].start <= end; last++){
+		start = MIN(start, map->extents[last].start);
+		if(map->extents[last].end > end) end = map->extents[last].end;
+	}
+
+	if(first == last){
+		if(map->count == map->alloc){
+			extents = realloc(map->extents, (map->alloc ? map->alloc * 2 : 64) * sizeof(struct extent));
+			if(!extents) return ENOMEM;
+
+			map->extents = extents;
+			map->alloc = map->alloc ? map->alloc * 2 : 64;
+		}
+
+		memmove(&map->extents[first + 1], &map->extents[first], (map->count - first) * sizeof(struct extent));
+		map->count++;
+	} else if(last - first > 1){
+		memmove(&map->extents[first + 1], &map->extents[last], (map->count - last) * sizeof(struct extent));
+		map->count -= last - first - 1;
+	}
+
+	map->extents[first].start = start;
+	map->extents[first].end = end;
+
+	return 0;
+}
+
+/*
+ * On a fresh image only the parts of a free that were written earlier in this
+ * stream hold anything, so those are the only parts that need zeroing.
+ */
+static int write_written_zeroes(FILE *outfile, FILE *manifest, struct extent_map *map, uint64_t offset, uint64_t length) {
+	int ret;
+	size_t i;
+	uint64_t start, end;
+
+	for(i = extent_map_find(map, offset); i < map->count && map->extents[i].start < offset + length; i++){
+		start = (map->extents[i].start > offset) ? map->extents[i].start : offset;
+		end = MIN(map->extents[i].end, offset + length);
+
+		ret = write_zeroes_entry(outfile, manifest, start, end - start);
+		if(ret) return ret;
+	}
+
+	return 0;
+}
+
 /***********************************/
 /****** ZFS PARSING FUNCTIONS ******/
 /***********************************/
 
-static int read_next(FILE *pipe, dmu_replay_record_t *drr, uint8_t *buf){
+/*
+ * Read the next record header and work out how much payload follows it. The
+ * payload is left in the pipe for the caller to stream or skip.
+ */
+static int read_next(FILE *pipe, dmu_replay_record_t *drr, uint64_t *payload_len){
 	int ret;
 	uint64_t data_len = 0;
 
@@ -231,11 +509,7 @@ static int read_next(FILE *pipe, dmu_replay_record_t *drr, uint8_t *buf){
 		break;
 	}
 
-	//read any additional data into the buffer
-	if(data_len > 0){
-		ret = read_data(pipe, buf, data_len);
-		if(ret) goto error;
-	}
+	*payload_len = data_len;
 
 	return 0;
 
@@ -244,52 +518,22 @@ error:
 	return ret;
 }
 
-static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
+static int zsend_convert_substream(FILE *pipe, dmu_replay_record_t *begin, FILE *outfile, FILE *manifest, uint64_t image_size, int fresh_image, struct chunk_buf *chunk) {
 	int ret;
 	dmu_replay_record_t drr;
-	uint8_t *buf = NULL;
-	uint64_t offset, length, object;
+	struct extent_map written = { 0 };
+	uint64_t offset, length, object, payload_len;
+	uint32_t crc;
 	char to_snap_name[24];
 	char from_snap_name[24];
 
-	//allocate a buffer for post-header data
-	buf = malloc(SPA_MAXBLOCKSIZE);
-	if(!buf){
-		ret = ENOMEM;
-		goto error;
-	}
-
-	//read first header (should be type DRR_BEGIN)
-	ret = read_header(pipe, &drr);
-	if(ret) goto error;
-
-	//confirm magic number
-	if(drr.drr_u.drr_begin.drr_magic != DMU_BACKUP_MAGIC) {
-		ret = EINVAL;
-		fprintf(stderr, "invalid magic number from pipe\n");
-		goto error;
-	}
-
-	// We only support zvol types
-	if (drr.drr_u.drr_begin.drr_type != DMU_OST_ZVOL) {
-		ret = EINVAL;
-		fprintf(stderr, "invalid type, only zvols are supported\n");
-		goto error;
-	}
-
-	//handle extra data that might be included after the DRR_BEGIN header
-	if((DMU_GET_STREAM_HDRTYPE(drr.drr_u.drr_begin.drr_versioninfo) == DMU_COMPOUNDSTREAM) && drr.drr_payloadlen != 0){
-		ret = read_skip(pipe, drr.drr_payloadlen);
-		if(ret) goto error;
-	}
-
 	// Begin writing some ceph information headers
 	ret = write_start_header(outfile);
 	if (ret) goto error;
 
 	// 0 GUID implies base send, which has no from snap
-	if (drr.drr_u.drr_begin.drr_fromguid != 0) { 
-		ret = snprintf(from_snap_name, 24, "%lu", drr.drr_u.drr_begin.drr_fromguid);
+	if (begin->drr_u.drr_begin.drr_fromguid != 0) { 
+		ret = snprintf(from_snap_name, 24, "%lu", begin->drr_u.drr_begin.drr_fromguid);
 		if (ret < 0) {
 			fprintf(stderr, "could not parse from snap guid\n");
 			goto error;
@@ -299,7 +543,7 @@ static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
 		if (ret) goto error;
 	}
 
-	ret = snprintf(to_snap_name, 24, "%lu", drr.drr_u.drr_begin.drr_toguid);
+	ret = snprintf(to_snap_name, 24, "%lu", begin->drr_u.drr_begin.drr_toguid);
 	if (ret < 0) {
 		fprintf(stderr, "could not parse to snap guid\n");
 		goto error;
@@ -308,23 +552,34 @@ static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
 	ret = write_tsnap(outfile, to_snap_name, strlen(to_snap_name));
 	if (ret) goto error;
 
+	if (manifest) {
+		ret = write_manifest_header(manifest);
+		if (ret) goto error;
+	}
+
 	if (image_size != 0) {
 		ret = write_image_size(outfile, image_size);
 		if (ret) goto error;
 	}
 
-	//main processing loop
-	while(!feof(pipe)){
-		ret = read_next(pipe, &drr, buf);
-		if(ret == EOF_SENTINEL) break;
-		else if(ret) goto error;
+	//only a full send can rely on the image starting out empty
+	if (begin->drr_u.drr_begin.drr_fromguid != 0) fresh_image = 0;
+
+	//main processing loop, runs until the DRR_END closing this substream
+	while(1){
+		//a substream cut off before its DRR_END is incomplete, not finished
+		ret = read_next(pipe, &drr, &payload_len);
+		if(ret == EOF_SENTINEL) ret = EIO;
+		if(ret) goto error;
+
+		if(drr.drr_type == DRR_END) break;
 
 		switch(drr.drr_type){
 		//we only care about writes
 		case DRR_WRITE:
 
 			object = drr.drr_u.drr_free.drr_object;
-			if (object != 1) continue;
+			if (object != 1) break;
 
 			//get the offset and length from the header
 			offset = drr.drr_u.drr_write.drr_offset;
@@ -335,28 +590,45 @@ static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
 			 * to determine the actual size. This is hard to parse outside of zfs core, so we
 			 * use the file size passed into us from stat instead.
 			 */
-			if(offset > image_size) continue;
+			if(offset > image_size) break;
 			if(offset + length > image_size) length = image_size - offset;
 
-			//write the zsend record to the output file
-			ret = write_block(outfile, offset, length, buf);
+			//write the zsend record to the output file, streaming the data straight through
+			ret = write_block(outfile, offset, length);
+			if(ret) goto error;
+
+			crc = 0;
+			ret = copy_data(pipe, outfile, chunk, length, manifest ? &crc : NULL);
 			if(ret) goto error;
 
+			payload_len -= length;
+
+			if(fresh_image){
+				ret = extent_map_add(&written, offset, offset + length);
+				if(ret) goto error;
+			}
+
+			if(manifest){
+				ret = write_manifest_entry(manifest, RBD_DIFF_WRITE, offset, length, crc);
+				if(ret) goto error;
+			}
+
 			break;
 		case DRR_FREE:
 			object = drr.drr_u.drr_free.drr_object;
-			if (object != 1) continue;
+			if (object != 1) break;
 
 			//get the offset and length from the header
 			offset = drr.drr_u.drr_free.drr_offset;
 			length = drr.drr_u.drr_free.drr_length;
 
 			//length == DMU_OBJECT_END indicates that length should go to the end of the file
-			if(offset > image_size) continue;
+			if(offset > image_size) break;
 			if(length == DMU_OBJECT_END || offset + length > image_size) length = image_size - offset;
 
-			//write the zsend record to the output file
-			ret = write_zeroes(outfile, offset, length);
+			//write the zsend record to the output file, or just the parts that undo earlier writes
+			if(fresh_image) ret = write_written_zeroes(outfile, manifest, &written, offset, length);
+			else ret = write_zeroes_entry(outfile, manifest, offset, length);
 			if(ret) goto error;
 
 			break;
@@ -364,10 +636,9 @@ static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
 		case DRR_OBJECT:
 		case DRR_SPILL:
 		case DRR_FREEOBJECTS:
-		case DRR_END:
 			break;
 		/*
-		 * DRR_BEGIN should never happen (we processed it above the loop).
+		 * DRR_BEGIN should never happen (the caller processed it before calling us).
 		 * We don't currently handle DRR_WRITE_EMBEDDED or DRR_WRITE_BYREF, but we didn't
 		 * ask for a dedup'ed or embedded stream when we opened the pipe so this should
 		 * never happen.
@@ -380,18 +651,321 @@ static int zsend_convert(FILE *pipe, FILE *outfile, uint64_t image_size) {
 			fprintf(stderr, "unexpected record type %d encountered\n", drr.drr_type);
 			goto error;
 		}
-	}
 
-	free(buf);
+		//discard whatever part of the payload was not written out
+		ret = read_skip(pipe, chunk, payload_len);
+		if(ret) goto error;
+	}
 
 	ret = write_end_header(outfile);
 	if (ret) goto error;
 
+	free(written.extents);
+
+	return 0;
+
+error:
+	fprintf(stderr, "failed to convert substream: %s\n", strerror(ret));
+	free(written.extents);
+	return ret;
+}
+
+static int zsend_skip_substream(FILE *pipe, struct chunk_buf *chunk) {
+	int ret;
+	dmu_replay_record_t drr;
+	uint64_t payload_len;
+
+	do {
+		ret = read_next(pipe, &drr, &payload_len);
+		if(ret == EOF_SENTINEL) ret = EIO;
+		if(ret) goto error;
+
+		ret = read_skip(pipe, chunk, payload_len);
+		if(ret) goto error;
+	} while(drr.drr_type != DRR_END);
+
+	return 0;
+
+error:
+	fprintf(stderr, "failed to skip substream: %s\n", strerror(ret));
+	return ret;
+}
+
+/**************************************/
+/****** SUBSTREAM DEMULTIPLEXING ******/
+/**************************************/
+
+static uint64_t lookup_image_size(struct convert_opts *opts, char *toname) {
+	size_t i, len;
+
+	//per-dataset sizes are keyed on the dataset name without the snapshot
+	len = strcspn(toname, "@");
+	for(i = 0; i < opts->nsizes; i++){
+		if(strlen(opts->sizes[i].dataset) == len && strncmp(opts->sizes[i].dataset, toname, len) == 0){
+			return opts->sizes[i].size;
+		}
+	}
+
+	return opts->image_size;
+}
+
+/*
+ * Outputs for each substream are named after the snapshot being sent, with the
+ * dataset's slashes flattened so "pool/vol@snap" becomes "<dir>/pool_vol@snap".
+ * Existing files are never overwritten, so flattened names that collide fail.
+ * The path opened is returned in path, which must hold PATH_MAX bytes.
+ */
+static int open_substream_file(char *dir, char *toname, char *path, FILE **file) {
+	int ret;
+	char *p;
+
+	ret = snprintf(path, PATH_MAX, "%s/%.*s", dir, MAXNAMELEN, toname);
+	if(ret < 0 || ret >= PATH_MAX){
+		ret = ENAMETOOLONG;
+		goto error;
+	}
+
+	for(p = path + strlen(dir) + 1; *p != '\0'; p++){
+		if(*p == '/') *p = '_';
+	}
+
+	*file = fopen(path, "wx");
+	if(!*file){
+		ret = errno;
+		goto error;
+	}
+
+	return 0;
+
+error:
+	fprintf(stderr, "failed to open output for %.*s: %s\n", MAXNAMELEN, toname, strerror(ret));
+	return ret;
+}
+
+static int close_substream_file(FILE *file) {
+	int ret;
+
+	if(fclose(file)){
+		ret = errno;
+		fprintf(stderr, "failed to close substream output: %s\n", strerror(ret));
+		return ret;
+	}
+
+	return 0;
+}
+
+static int path_list_add(struct path_list *list, char *path) {
+	char **paths;
+
+	paths = realloc(list->paths, (list->count + 1) * sizeof(char *));
+	if(!paths) return ENOMEM;
+	list->paths = paths;
+
+	list->paths[list->count] = strdup(path);
+	if(!list->paths[list->count]) return ENOMEM;
+	list->count++;
+
+	return 0;
+}
+
+static void path_list_unlink(struct path_list *list) {
+	size_t i;
+
+	for(i = 0; i < list->count; i++){
+		unlink(list->paths[i]);
+	}
+}
+
+static void path_list_free(struct path_list *list) {
+	size_t i;
+
+	for(i = 0; i < list->count; i++){
+		free(list->paths[i]);
+	}
+	free(list->paths);
+}
+
+static int zsend_route_substream(FILE *pipe, dmu_replay_record_t *begin, struct convert_opts *opts, struct chunk_buf *chunk, struct path_list *created) {
+	int ret;
+	uint64_t image_size;
+	FILE *outfile = opts->outfile;
+	FILE *manifest = opts->manifest;
+	char toname[MAXNAMELEN + 1];
+	char out_path[PATH_MAX] = "";
+	char manifest_path[PATH_MAX] = "";
+
+	//confirm magic number
+	if(begin->drr_u.drr_begin.drr_magic != DMU_BACKUP_MAGIC) {
+		ret = EINVAL;
+		fprintf(stderr, "invalid magic number from pipe\n");
+		goto error;
+	}
+
+	//handle extra data that might be included after the DRR_BEGIN header
+	if(begin->drr_payloadlen != 0){
+		ret = read_skip(pipe, chunk, begin->drr_payloadlen);
+		if(ret) goto error;
+	}
+
+	memcpy(toname, begin->drr_u.drr_begin.drr_toname, MAXNAMELEN);
+	toname[MAXNAMELEN] = '\0';
+
+	// We only support zvol types, but replication streams may carry their parents too
+	if (begin->drr_u.drr_begin.drr_type != DMU_OST_ZVOL) {
+		if (!opts->out_dir) {
+			ret = EINVAL;
+			fprintf(stderr, "invalid type, only zvols are supported\n");
+			goto error;
+		}
+
+		fprintf(stderr, "skipping %s, only zvols are supported\n", toname);
+		return zsend_skip_substream(pipe, chunk);
+	}
+
+	image_size = lookup_image_size(opts, toname);
+	if (image_size == 0) {
+		ret = EINVAL;
+		fprintf(stderr, "no image size given for %s\n", toname);
+		goto error;
+	}
+
+	if (opts->out_dir) {
+		outfile = manifest = NULL;
+
+		ret = open_substream_file(opts->out_dir, toname, out_path, &outfile);
+		if (ret) {
+			out_path[0] = '\0';
+			goto error;
+		}
+
+		if (opts->manifest_dir) {
+			ret = open_substream_file(opts->manifest_dir, toname, manifest_path, &manifest);
+			if (ret) {
+				manifest_path[0] = '\0';
+				goto error;
+			}
+		}
+	}
+
+	ret = zsend_convert_substream(pipe, begin, outfile, manifest, image_size, opts->fresh_image, chunk);
+	if (ret) goto error;
+
+	if (opts->out_dir) {
+		ret = close_substream_file(outfile);
+		outfile = NULL;
+		if (ret) goto error;
+
+		if (manifest) {
+			ret = close_substream_file(manifest);
+			manifest = NULL;
+			if (ret) goto error;
+		}
+
+		ret = path_list_add(created, out_path);
+		if (ret) goto error;
+
+		if (manifest_path[0] != '\0') {
+			ret = path_list_add(created, manifest_path);
+			if (ret) goto error;
+		}
+	}
+
+	return 0;
+
+error:
+	if (opts->out_dir && outfile) fclose(outfile);
+	if (opts->out_dir && manifest) fclose(manifest);
+
+	//don't leave partial outputs behind, they would block a rerun into the same directory
+	if (out_path[0] != '\0') unlink(out_path);
+	if (manifest_path[0] != '\0') unlink(manifest_path);
+
+	return ret;
+}
+
+static int zsend_convert(FILE *pipe, struct convert_opts *opts) {
+	int ret;
+	dmu_replay_record_t drr;
+	struct chunk_buf chunk = { 0 };
+	struct path_list created = { 0 };
+
+	//allocate a single buffer for post-header data, reused for every record of every substream
+	ret = chunk_alloc(&chunk, opts->chunk_size);
+	if(ret) goto error;
+
+	//read first header (should be type DRR_BEGIN)
+	ret = read_header(pipe, &drr);
+	if(ret == EOF_SENTINEL) ret = EIO;
+	if(ret) goto error;
+
+	if(DMU_GET_STREAM_HDRTYPE(drr.drr_u.drr_begin.drr_versioninfo) != DMU_COMPOUNDSTREAM){
+		ret = zsend_route_substream(pipe, &drr, opts, &chunk, &created);
+		if(ret) goto error;
+
+		chunk_free(&chunk);
+		path_list_free(&created);
+		return 0;
+	}
+
+	//replication (-R) streams: an nvlist describing the package, then one substream per snapshot
+	if(drr.drr_u.drr_begin.drr_magic != DMU_BACKUP_MAGIC) {
+		ret = EINVAL;
+		fprintf(stderr, "invalid magic number from pipe\n");
+		goto error;
+	}
+
+	if (!opts->out_dir) {
+		ret = EINVAL;
+		fprintf(stderr, "replication streams require an output directory\n");
+		goto error;
+	}
+
+	if(drr.drr_payloadlen != 0){
+		ret = read_skip(pipe, &chunk, drr.drr_payloadlen);
+		if(ret) goto error;
+	}
+
+	//the nvlist is closed by a DRR_END of its own before the first substream
+	ret = read_header(pipe, &drr);
+	if(ret == EOF_SENTINEL) ret = EIO;
+	if(ret) goto error;
+
+	if(drr.drr_type != DRR_END){
+		ret = EINVAL;
+		fprintf(stderr, "unexpected record type %d after replication stream header\n", drr.drr_type);
+		goto error;
+	}
+
+	//the package is terminated by another DRR_END after the last substream
+	while(1){
+		ret = read_header(pipe, &drr);
+		if(ret == EOF_SENTINEL) ret = EIO;
+		if(ret) goto error;
+
+		if(drr.drr_type == DRR_END) break;
+
+		if(drr.drr_type != DRR_BEGIN){
+			ret = EINVAL;
+			fprintf(stderr, "unexpected record type %d between substreams\n", drr.drr_type);
+			goto error;
+		}
+
+		ret = zsend_route_substream(pipe, &drr, opts, &chunk, &created);
+		if(ret) goto error;
+	}
+
+	chunk_free(&chunk);
+	path_list_free(&created);
+
 	return 0;
 
 error:
 	fprintf(stderr, "parse failed: %s\n", strerror(ret));
-	if(buf) free(buf);
+	chunk_free(&chunk);
+
+	//an incomplete package is removed entirely, so it can be rerun into the same directory
+	path_list_unlink(&created);
+	path_list_free(&created);
 
 	return ret;
 }
@@ -403,35 +977,104 @@ error:
 
 static void print_usage(int exitcode){
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "\tzfs2ceph -s <image size>\n");
+	fprintf(stderr, "\tzfs2ceph -s <image size> [-m <manifest file>] [-b <chunk size>] [-F]\n");
+	fprintf(stderr, "\tzfs2ceph -o <output dir> -s [<zvol>=]<image size> ... [-m <manifest dir>] [-b <chunk size>] [-F]\n");
 	fprintf(stderr, "Note:\n");
 	fprintf(stderr, "\t<image_size> is specified in bytes\n");
+	fprintf(stderr, "\t<manifest file> receives the crc32c of every extent written to the diff\n");
+	fprintf(stderr, "\t<output dir> receives one diff per snapshot, as needed for replication (-R) streams\n");
+	fprintf(stderr, "\t<zvol>=<image size> sets the size for one zvol, a bare size is the default\n");
+	fprintf(stderr, "\t<chunk size> is the buffer used to stream records in bytes, 2MiB by default\n");
+	fprintf(stderr, "\t-F marks the target of full sends as a new, empty image, so unwritten ranges are not zeroed\n");
 	exit(exitcode);
 }
 
+static int parse_image_size(char *arg, struct convert_opts *opts) {
+	struct dataset_size *sizes;
+	char *sep;
+
+	sep = strrchr(arg, '=');
+	if (!sep) {
+		opts->image_size = atol(arg);
+		return 0;
+	}
+
+	sizes = realloc(opts->sizes, (opts->nsizes + 1) * sizeof(struct dataset_size));
+	if (!sizes) return ENOMEM;
+
+	*sep = '\0';
+	sizes[opts->nsizes].dataset = arg;
+	sizes[opts->nsizes].size = atol(sep + 1);
+
+	opts->sizes = sizes;
+	opts->nsizes++;
+
+	return 0;
+}
+
 int main(int argc, char **argv) {
-	uint64_t image_size = 0;
+	int ret;
+	struct convert_opts opts = { .chunk_size = DEFAULT_CHUNK_SIZE };
+	char *manifest_path = NULL;
 	char c;
 
-	while((c = getopt(argc, argv, "s:")) != -1){
+	while((c = getopt(argc, argv, "s:m:o:b:F")) != -1){
 		switch(c){
 		case 's':
-			image_size = atol(optarg);
+			ret = parse_image_size(optarg, &opts);
+			if (ret) return ret;
+			break;
+		case 'm':
+			manifest_path = optarg;
+			break;
+		case 'o':
+			opts.out_dir = optarg;
+			break;
+		case 'b':
+			opts.chunk_size = atol(optarg);
+			break;
+		case 'F':
+			opts.fresh_image = 1;
 			break;
 		default:
 			print_usage(EINVAL);
 		}
 	}
 
-	if (image_size == 0) {
+	if (opts.chunk_size == 0 || (opts.image_size == 0 && (opts.nsizes == 0 || !opts.out_dir))) {
 		print_usage(EINVAL);
 	}
 
-	if (isatty(fileno(stdout))) {
-		fprintf(stderr, "%s does not support output to tty\n", argv[0]);
-		return EINVAL;
+	if (opts.out_dir) {
+		opts.manifest_dir = manifest_path;
+	} else {
+		if (isatty(fileno(stdout))) {
+			fprintf(stderr, "%s does not support output to tty\n", argv[0]);
+			return EINVAL;
+		}
+
+		opts.outfile = stdout;
+
+		if (manifest_path) {
+			opts.manifest = fopen(manifest_path, "w");
+			if (!opts.manifest) {
+				ret = errno;
+				fprintf(stderr, "failed to open manifest %s: %s\n", manifest_path, strerror(ret));
+				return ret;
+			}
+		}
 	}
 
-	return zsend_convert(stdin, stdout, image_size);
-}
+	crc32c_init();
+
+	ret = zsend_convert(stdin, &opts);
 
+	if (opts.manifest && fclose(opts.manifest) && !ret) {
+		ret = errno;
+		fprintf(stderr, "failed to close manifest %s: %s\n", manifest_path, strerror(ret));
+	}
+
+	free(opts.sizes);
+
+	return ret;
+}